@@ -54,6 +54,27 @@ static VCL_STRING vmod_keystore_memcached_get(struct ws *ws, void *c, VCL_STRING
     return vvalue;
 }
 
+static int vmod_keystore_memcached_fetch(void *c, VCL_STRING key, int (*cb)(void *, const char *, size_t), void *cbarg)
+{
+    int ret;
+    char *ovalue;
+    uint32_t flags;
+    size_t ovalue_len;
+    memcached_return_t rc;
+
+    if (NULL == (ovalue = memcached_get((memcached_st *) c, key, strlen(key), &ovalue_len, &flags, &rc))) {
+        if (MEMCACHED_NOTFOUND == rc) {
+            return 0;
+        }
+        VSL(SLT_Error, 0, "memcached: failed to get '%s': %s", key, memcached_strerror((memcached_st *) c, rc));
+        return -1;
+    }
+    ret = cb(cbarg, ovalue, ovalue_len) ? 1 : -1;
+    free(ovalue);
+
+    return ret;
+}
+
 static int _memcached_do_set_add_replace(
     memcached_return_t (*fn)(memcached_st *, const char *, size_t, const char *, size_t, time_t, uint32_t),
     void *c,
@@ -134,6 +155,25 @@ static VCL_INT vmod_keystore_memcached_decrement(void *c, VCL_STRING key)
     return _memcached_do_in_de_crement(memcached_decrement_with_initial, c, key);
 }
 
+static VCL_VOID vmod_keystore_memcached_increment_by(void *c, size_t count, const char * const *keys, const VCL_INT *deltas)
+{
+    size_t i;
+    uint64_t ovalue;
+    memcached_return_t rc;
+
+    for (i = 0; i < count; i++) {
+        if (deltas[i] > 0) {
+            rc = memcached_increment_with_initial((memcached_st *) c, keys[i], strlen(keys[i]), (uint64_t) deltas[i], (uint64_t) deltas[i], 0, &ovalue);
+        } else {
+            /* memcached does not go below 0 */
+            rc = memcached_decrement_with_initial((memcached_st *) c, keys[i], strlen(keys[i]), (uint64_t) -deltas[i], 0, 0, &ovalue);
+        }
+        if (MEMCACHED_SUCCESS != rc) {
+            VSL(SLT_Error, 0, "memcached: counter '%s' dropped: %s", keys[i], memcached_strerror((memcached_st *) c, rc));
+        }
+    }
+}
+
 #ifdef MEMCACHED_SHARED_DRIVER
 static
 #endif /* MEMCACHED_SHARED_DRIVER */
@@ -149,6 +189,11 @@ const vmod_keystore_driver_imp memcached_driver = {
     vmod_keystore_memcached_expire,
     vmod_keystore_memcached_increment,
     vmod_keystore_memcached_decrement,
+    NULL,
+    vmod_keystore_memcached_increment_by,
+    vmod_keystore_memcached_fetch,
+    NULL,
+    NULL,
     NULL
 };
 
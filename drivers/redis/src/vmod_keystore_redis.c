@@ -1,8 +1,11 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <poll.h>
 
 #include "vrt.h"
+#include "vtim.h"
 #include "cache/cache.h"
 #ifdef REDIS_SHARED_DRIVER
 # include "vcc_if.h"
@@ -11,20 +14,110 @@
 
 #include <hiredis.h>
 
+#define REDIS_FETCH_CHUNK (64 * 1024)
+#define REDIS_FETCH_ATTEMPTS 3
+#define REDIS_MAX_REPLICAS 4
+#define REDIS_DEFAULT_PORT 6379
+#define REDIS_HEDGE_PERCENTILE 0.95
+#define REDIS_HEDGE_DEFAULT_RATIO 0.05
+/* hedges which can be saved up while the primary is fast, in thousandths */
+#define REDIS_HEDGE_BURST (10 * 1000)
+/* delay before trying again to connect to a failed replica */
+#define REDIS_REPLICA_RETRY 1.0
+/* lost hedged reads a replica may still owe before its connection is dropped */
+#define REDIS_REPLICA_MAX_PENDING 8
+
+struct vmod_keystore_redis_conn_t;
+
+/**
+ * Each thread has its own connection, through a pthread key per instance
+ * (instances with different hosts must not share them). Connections are
+ * also listed in conns so they can all be freed by close: pthread_key_delete
+ * does not call the destructor for threads still alive (nor wait for the
+ * ones currently running).
+ *
+ * With replicas and hedge_after set, a read (get, exists) not answered
+ * by the primary after max(hedge_after, estimated percentile of its
+ * latency) is also sent to a replica and the first reply wins. Each read
+ * earns hedge_ratio of a hedge (hedge_tokens, in thousandths, capped to
+ * REDIS_HEDGE_BURST) and each hedge costs a whole one, so a stall of the
+ * primary after a quiet period does not hedge every read. Statistics are
+ * updated lock free.
+ **/
 struct vmod_keystore_redis_data_t {
     unsigned magic;
 #define REDIS_MAGIC 0x0066feff
     int port;
     char *host;
     struct timeval tv;
+    pthread_key_t key;
+    int replicas_count;
+    struct {
+        char *host;
+        int port;
+    } replicas[REDIS_MAX_REPLICAS];
+    double hedge_after;
+    double hedge_ratio;
+    double hedge_percentile;
+    long hedge_earn;
+    long hedge_tokens;
+    unsigned long reads;
+    unsigned long hedged;
+    unsigned long won;
 };
 
-static pthread_key_t key;
-static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+struct vmod_keystore_redis_conn_t {
+    unsigned magic;
+#define REDIS_CONN_MAGIC 0x0166feff
+    redisContext *ctxt;
+    redisContext *replicas[REDIS_MAX_REPLICAS];
+    /* replies of lost hedged reads still to be read, [0] for ctxt, [1 + i] for replicas[i] */
+    unsigned int pending[1 + REDIS_MAX_REPLICAS];
+    unsigned int next_replica;
+    /* VTIM_mono() before which replicas[i] is not reconnected after a failure */
+    double retry_after[REDIS_MAX_REPLICAS];
+    pthread_t owner;
+    struct vmod_keystore_redis_data_t *d;
+    VTAILQ_ENTRY(vmod_keystore_redis_conn_t) list;
+};
+
+/* connections of all instances: unlike their instance, the lock outlives a close */
+static pthread_mutex_t conns_mtx = PTHREAD_MUTEX_INITIALIZER;
+static VTAILQ_HEAD(, vmod_keystore_redis_conn_t) conns = VTAILQ_HEAD_INITIALIZER(conns);
+
+static void _redis_conn_destroy(struct vmod_keystore_redis_conn_t *conn)
+{
+    int i;
+
+    redisFree(conn->ctxt);
+    for (i = 0; i < REDIS_MAX_REPLICAS; i++) {
+        if (NULL != conn->replicas[i]) {
+            redisFree(conn->replicas[i]);
+        }
+    }
+    FREE_OBJ(conn);
+}
 
-static void make_key(void)
+static void _redis_conn_free(void *arg)
 {
-    pthread_key_create(&key, (void (*)(void *)) redisFree);
+    struct vmod_keystore_redis_conn_t *conn;
+
+    /**
+     * close may run at the same time (exiting thread) and already have
+     * freed this connection: only dereference it if still listed
+     **/
+    AZ(pthread_mutex_lock(&conns_mtx));
+    VTAILQ_FOREACH(conn, &conns, list) {
+        if (conn == arg && pthread_equal(conn->owner, pthread_self())) {
+            VTAILQ_REMOVE(&conns, conn, list);
+            break;
+        }
+    }
+    AZ(pthread_mutex_unlock(&conns_mtx));
+    if (NULL != conn) {
+        CHECK_OBJ(conn, REDIS_CONN_MAGIC);
+        _redis_conn_destroy(conn);
+    }
 }
 
 static void *vmod_keystore_redis_open(const char *host, int port, struct timeval tv)
@@ -36,38 +129,122 @@ static void *vmod_keystore_redis_open(const char *host, int port, struct timeval
     d->port = port;
     d->host = strdup(host);
     d->tv = tv;
+    d->hedge_ratio = REDIS_HEDGE_DEFAULT_RATIO;
+    d->hedge_earn = (long) (REDIS_HEDGE_DEFAULT_RATIO * 1000.0);
+    d->hedge_tokens = REDIS_HEDGE_BURST;
+    AZ(pthread_key_create(&d->key, _redis_conn_free));
 
     return d;
 }
 
 static void vmod_keystore_redis_close(void *c)
 {
+    int i;
     struct vmod_keystore_redis_data_t *d;
+    struct vmod_keystore_redis_conn_t *conn, *next;
 
     d = (struct vmod_keystore_redis_data_t *) c;
     CHECK_OBJ_NOTNULL(d, REDIS_MAGIC);
+    AZ(pthread_key_delete(d->key));
+    AZ(pthread_mutex_lock(&conns_mtx));
+    VTAILQ_FOREACH_SAFE(conn, &conns, list, next) {
+        if (conn->d == d) {
+            VTAILQ_REMOVE(&conns, conn, list);
+            _redis_conn_destroy(conn);
+        }
+    }
+    AZ(pthread_mutex_unlock(&conns_mtx));
+    for (i = 0; i < d->replicas_count; i++) {
+        free(d->replicas[i].host);
+    }
 //     AN(d->host);
     free(d->host);
     FREE_OBJ(d);
 }
 
-static redisContext *_redis_do_connect(struct vmod_keystore_redis_data_t *d)
+static int vmod_keystore_redis_configure(void *c, const char *name, const char *value)
+{
+    struct vmod_keystore_redis_data_t *d;
+
+    d = (struct vmod_keystore_redis_data_t *) c;
+    CHECK_OBJ_NOTNULL(d, REDIS_MAGIC);
+    if (0 == strcmp(name, "replicas")) {
+        long port;
+        char *endptr;
+        const char *end, *colon;
+
+        /* host:port or /path/to/socket, separated by commas */
+        while ('\0' != *value) {
+            if (d->replicas_count >= REDIS_MAX_REPLICAS) {
+                return 0;
+            }
+            if (NULL == (end = strchr(value, ','))) {
+                end = value + strlen(value);
+            }
+            colon = memchr(value, ':', end - value);
+            if ('/' == *value) {
+                d->replicas[d->replicas_count].host = strndup(value, end - value);
+                d->replicas[d->replicas_count].port = -1;
+            } else if (NULL == colon) {
+                d->replicas[d->replicas_count].host = strndup(value, end - value);
+                d->replicas[d->replicas_count].port = REDIS_DEFAULT_PORT;
+            } else {
+                port = strtol(colon + 1, &endptr, 10);
+                if (colon == value || endptr != end || port <= 0 || port > 65535) {
+                    return 0;
+                }
+                d->replicas[d->replicas_count].host = strndup(value, colon - value);
+                d->replicas[d->replicas_count].port = (int) port;
+            }
+            AN(d->replicas[d->replicas_count].host);
+            if ('\0' == *d->replicas[d->replicas_count].host) {
+                free(d->replicas[d->replicas_count].host);
+                return 0;
+            }
+            ++d->replicas_count;
+            value = '\0' == *end ? end : end + 1;
+        }
+    } else if (0 == strcmp(name, "hedge_after")) {
+        struct timeval tv;
+
+        if (!vmod_keystore_parse_tv(value, &tv) || tv.tv_sec < 0 || tv.tv_usec < 0) {
+            return 0;
+        }
+        d->hedge_after = (double) tv.tv_sec + (double) tv.tv_usec / 1000000.0;
+        d->hedge_percentile = d->hedge_after;
+    } else if (0 == strcmp(name, "hedge_ratio")) {
+        double ratio;
+        char *endptr;
+
+        ratio = strtod(value, &endptr);
+        if (endptr == value || '\0' != *endptr || !(ratio >= 0 && ratio <= 1)) {
+            return 0;
+        }
+        d->hedge_ratio = ratio;
+        d->hedge_earn = (long) (ratio * 1000.0);
+    } else {
+        return 0;
+    }
+
+    return 1;
+}
+
+static redisContext *_redis_do_connect(const char *host, int port, struct timeval tv)
 {
     int tv_set;
 
-    /* caller is responsible of CHECK_OBJ_NOTNULL(d, REDIS_MAGIC) */
-    tv_set = 0 != d->tv.tv_sec && 0 != d->tv.tv_usec;
-    if (-1 == d->port) {
+    tv_set = 0 != tv.tv_sec && 0 != tv.tv_usec;
+    if (-1 == port) {
         if (tv_set) {
-            return redisConnectUnixWithTimeout(d->host, d->tv);
+            return redisConnectUnixWithTimeout(host, tv);
         } else {
-            return redisConnectUnix(d->host);
+            return redisConnectUnix(host);
         }
     } else {
         if (tv_set) {
-            return redisConnectWithTimeout(d->host, d->port, d->tv);
+            return redisConnectWithTimeout(host, port, tv);
         } else {
-            return redisConnect(d->host, d->port);
+            return redisConnect(host, port);
         }
     }
 //     if (NULL != d->c && d->c->err) {
@@ -75,28 +252,364 @@ static redisContext *_redis_do_connect(struct vmod_keystore_redis_data_t *d)
 //     }
 }
 
-static int _redis_do_string_command(struct ws *ws, void *c, int *output_type, char **output_value, const char *command, ...)
+static struct vmod_keystore_redis_conn_t *_redis_get_conn(struct vmod_keystore_redis_data_t *d)
+{
+    struct vmod_keystore_redis_conn_t *conn;
+
+    /* caller is responsible of CHECK_OBJ_NOTNULL(d, REDIS_MAGIC) */
+    if (NULL == (conn = (struct vmod_keystore_redis_conn_t *) pthread_getspecific(d->key))) {
+        ALLOC_OBJ(conn, REDIS_CONN_MAGIC);
+        AN(conn);
+        conn->d = d;
+        conn->owner = pthread_self();
+        conn->ctxt = _redis_do_connect(d->host, d->port, d->tv);
+        AN(conn->ctxt);
+        AZ(pthread_mutex_lock(&conns_mtx));
+        VTAILQ_INSERT_TAIL(&conns, conn, list);
+        AZ(pthread_mutex_unlock(&conns_mtx));
+        AZ(pthread_setspecific(d->key, conn));
+    } else if (conn->ctxt->err) {
+        /* a hiredis context is unusable once an error occurred (server restarted, ...), reconnect */
+        redisFree(conn->ctxt);
+        conn->ctxt = _redis_do_connect(d->host, d->port, d->tv);
+        AN(conn->ctxt);
+        conn->pending[0] = 0;
+    }
+
+    return conn;
+}
+
+/* discard the replies of previously lost hedged reads */
+static void _redis_drain(redisContext *ctxt, unsigned int *pending)
 {
-    int ret;
-    va_list ap;
     redisReply *r;
-    redisContext *ctxt;
+
+    while (*pending > 0) {
+        if (REDIS_OK != redisGetReply(ctxt, (void **) &r)) {
+            *pending = 0;
+            break;
+        }
+        freeReplyObject(r);
+        --*pending;
+    }
+}
+
+static redisContext *_redis_get_context(struct vmod_keystore_redis_data_t *d)
+{
+    struct vmod_keystore_redis_conn_t *conn;
+
+    conn = _redis_get_conn(d);
+    _redis_drain(conn->ctxt, &conn->pending[0]);
+
+    return conn->ctxt;
+}
+
+/**
+ * Discard, without waiting, the replies of lost hedged reads a replica
+ * has already sent. Returns 0 if some are still to come (or on error).
+ **/
+static int _redis_drain_nowait(redisContext *ctxt, unsigned int *pending)
+{
+    redisReply *r;
+    struct pollfd pfd;
+
+    while (*pending > 0) {
+        if (REDIS_OK != redisGetReplyFromReader(ctxt, (void **) &r)) {
+            return 0;
+        }
+        if (NULL != r) {
+            freeReplyObject(r);
+            --*pending;
+            continue;
+        }
+        pfd.fd = ctxt->fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (1 != poll(&pfd, 1, 0) || REDIS_OK != redisBufferRead(ctxt)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void _redis_drop_replica(struct vmod_keystore_redis_conn_t *conn, int i, double now)
+{
+    redisFree(conn->replicas[i]);
+    conn->replicas[i] = NULL;
+    conn->pending[1 + i] = 0;
+    conn->retry_after[i] = now + REDIS_REPLICA_RETRY;
+}
+
+/**
+ * Next replica ready to take a hedged read: the ones still owing replies
+ * are skipped, and failed ones are not reconnected before retry_after.
+ **/
+static redisContext *_redis_get_replica_context(struct vmod_keystore_redis_conn_t *conn, int *index)
+{
+    int i, n;
+    double now;
     struct vmod_keystore_redis_data_t *d;
 
-    d = (struct vmod_keystore_redis_data_t *) c;
-    CHECK_OBJ_NOTNULL(d, REDIS_MAGIC);
-    ret = 1;
-    va_start(ap, command);
-    if (NULL == (ctxt = (redisContext *) pthread_getspecific(key))) {
-        ctxt = _redis_do_connect(d);
-        AN(ctxt);
-        pthread_setspecific(key, ctxt);
+    d = conn->d;
+    now = VTIM_mono();
+    for (n = 0; n < d->replicas_count; n++) {
+        i = conn->next_replica++ % d->replicas_count;
+        if (NULL == conn->replicas[i]) {
+            if (now < conn->retry_after[i]) {
+                continue;
+            }
+            if (NULL == (conn->replicas[i] = _redis_do_connect(d->replicas[i].host, d->replicas[i].port, d->tv))) {
+                conn->retry_after[i] = now + REDIS_REPLICA_RETRY;
+                continue;
+            }
+        }
+        if (conn->replicas[i]->err) {
+            _redis_drop_replica(conn, i, now);
+            continue;
+        }
+        if (!_redis_drain_nowait(conn->replicas[i], &conn->pending[1 + i])) {
+            if (conn->replicas[i]->err || conn->pending[1 + i] > REDIS_REPLICA_MAX_PENDING) {
+                _redis_drop_replica(conn, i, now);
+            }
+            continue;
+        }
+        *index = i;
+        return conn->replicas[i];
     }
-//     r = redisvCommand(ctxt, command, ap);
-    redisvAppendCommand(ctxt, command, ap);
-    va_end(ap);
-    if (REDIS_OK == redisGetReply(ctxt, (void **) &r)) {
-        AN(r);
+
+    return NULL;
+}
+
+/* earn hedge_ratio of a hedge for a read */
+static void _redis_hedge_earn(struct vmod_keystore_redis_data_t *d)
+{
+    long old, new;
+
+    do {
+        old = d->hedge_tokens;
+        if ((new = old + d->hedge_earn) > REDIS_HEDGE_BURST) {
+            new = REDIS_HEDGE_BURST;
+        }
+    } while (new != old && !__sync_bool_compare_and_swap(&d->hedge_tokens, old, new));
+}
+
+/* returns 1 if a whole hedge was available (and takes it) */
+static int _redis_hedge_take(struct vmod_keystore_redis_data_t *d)
+{
+    long old;
+
+    do {
+        if ((old = d->hedge_tokens) < 1000) {
+            return 0;
+        }
+    } while (!__sync_bool_compare_and_swap(&d->hedge_tokens, old, old - 1000));
+
+    return 1;
+}
+
+static double _redis_hedge_threshold(struct vmod_keystore_redis_data_t *d)
+{
+    double percentile;
+
+    __atomic_load(&d->hedge_percentile, &percentile, __ATOMIC_RELAXED);
+
+    return percentile > d->hedge_after ? percentile : d->hedge_after;
+}
+
+/**
+ * Stochastic approximation of the percentile of primary latencies. Updates
+ * racing each other may lose a step, which only slows the estimate down.
+ **/
+static void _redis_hedge_observe(struct vmod_keystore_redis_data_t *d, double latency)
+{
+    double percentile, step;
+
+    __atomic_load(&d->hedge_percentile, &percentile, __ATOMIC_RELAXED);
+    step = (percentile > 0.0001 ? percentile : 0.0001) * 0.05;
+    if (latency > percentile) {
+        percentile += step * REDIS_HEDGE_PERCENTILE;
+    } else {
+        percentile -= step * (1 - REDIS_HEDGE_PERCENTILE);
+    }
+    __atomic_store(&d->hedge_percentile, &percentile, __ATOMIC_RELAXED);
+}
+
+static int _redis_send(redisContext *ctxt, const char *command, const char *key)
+{
+    int done;
+
+    if (REDIS_OK != redisAppendCommand(ctxt, command, key)) {
+        return 0;
+    }
+    do {
+        if (REDIS_OK != redisBufferWrite(ctxt, &done)) {
+            return 0;
+        }
+    } while (!done);
+
+    return 1;
+}
+
+/**
+ * Wait at most timeout seconds (without limit if negative) for the first
+ * reply of count contexts. Returns the index of the context which answered,
+ * -1 on timeout or -2 if all of them failed.
+ **/
+static int _redis_wait_reply(redisContext **ctxts, int count, double timeout, redisReply **r)
+{
+    int i, ms, alive;
+    double start, left;
+    struct pollfd pfd[2];
+
+    assert(count <= 2);
+    start = VTIM_mono();
+    for (i = 0; i < count; i++) {
+        pfd[i].fd = ctxts[i]->fd;
+        pfd[i].events = POLLIN;
+    }
+    while (1) {
+        alive = 0;
+        for (i = 0; i < count; i++) {
+            if (pfd[i].fd < 0) {
+                continue;
+            }
+            if (REDIS_OK != redisGetReplyFromReader(ctxts[i], (void **) r)) {
+                pfd[i].fd = -1;
+                continue;
+            }
+            if (NULL != *r) {
+                return i;
+            }
+            ++alive;
+        }
+        if (0 == alive) {
+            return -2;
+        }
+        if (timeout < 0) {
+            ms = -1;
+        } else {
+            left = timeout - (VTIM_mono() - start);
+            if (left <= 0) {
+                return -1;
+            }
+            ms = (int) (left * 1000.0) + 1;
+        }
+        for (i = 0; i < count; i++) {
+            pfd[i].revents = 0;
+        }
+        if (-1 == poll(pfd, count, ms)) {
+            if (EINTR == errno) {
+                continue;
+            }
+            return -2;
+        }
+        for (i = 0; i < count; i++) {
+            if (pfd[i].fd >= 0 && 0 != (pfd[i].revents & (POLLIN | POLLERR | POLLHUP))) {
+                if (REDIS_OK != redisBufferRead(ctxts[i])) {
+                    pfd[i].fd = -1;
+                }
+            }
+        }
+    }
+}
+
+/* what is left of timeout (without limit if negative) since start */
+static double _redis_time_left(double timeout, double start)
+{
+    double left;
+
+    if (timeout < 0) {
+        return -1;
+    }
+    left = timeout - (VTIM_mono() - start);
+
+    return left > 0 ? left : 0;
+}
+
+/* send a read only command, hedged when replicas are set ; NULL on timeout or failure */
+static redisReply *_redis_read_command(struct vmod_keystore_redis_data_t *d, const char *command, const char *key)
+{
+    redisReply *r;
+    int i, winner;
+    redisContext *ctxts[2];
+    double start, timeout, threshold;
+    struct vmod_keystore_redis_conn_t *conn;
+
+    r = NULL;
+    conn = _redis_get_conn(d);
+    ctxts[0] = conn->ctxt;
+    if (0 == d->replicas_count || d->hedge_after <= 0) {
+        _redis_drain(ctxts[0], &conn->pending[0]);
+        redisAppendCommand(ctxts[0], command, key);
+        if (REDIS_OK != redisGetReply(ctxts[0], (void **) &r)) {
+            return NULL;
+        }
+        return r;
+    }
+    start = VTIM_mono();
+    timeout = 0 == d->tv.tv_sec && 0 == d->tv.tv_usec ? -1 : (double) d->tv.tv_sec + (double) d->tv.tv_usec / 1000000.0;
+    __sync_fetch_and_add(&d->reads, 1);
+    _redis_hedge_earn(d);
+    i = -1;
+    if (!_redis_drain_nowait(ctxts[0], &conn->pending[0])) {
+        /* the primary still owes the replies of reads a replica won: don't queue behind them */
+        if (NULL != (ctxts[1] = _redis_get_replica_context(conn, &i)) && _redis_send(ctxts[1], command, key)) {
+            if ((winner = _redis_wait_reply(&ctxts[1], 1, timeout, &r)) < 0) {
+                ++conn->pending[1 + i];
+            }
+            return winner >= 0 ? r : NULL;
+        }
+        i = -1;
+        _redis_drain(ctxts[0], &conn->pending[0]);
+    }
+    if (!_redis_send(ctxts[0], command, key)) {
+        return NULL;
+    }
+    threshold = _redis_hedge_threshold(d);
+    if (timeout >= 0 && timeout < threshold) {
+        threshold = timeout;
+    }
+    if (-1 == (winner = _redis_wait_reply(ctxts, 1, threshold, &r))) {
+        if (_redis_hedge_take(d)) {
+            if (NULL != (ctxts[1] = _redis_get_replica_context(conn, &i)) && _redis_send(ctxts[1], command, key)) {
+                __sync_fetch_and_add(&d->hedged, 1);
+            } else {
+                /* nothing was sent, give the hedge back */
+                __sync_fetch_and_add(&d->hedge_tokens, 1000);
+                i = -1;
+            }
+        }
+        winner = _redis_wait_reply(ctxts, -1 == i ? 1 : 2, _redis_time_left(timeout, start), &r);
+        /* the ones which did not answer will reply later, read their answer before reusing them */
+        if (0 != winner) {
+            ++conn->pending[0];
+        }
+        if (-1 != i && 1 != winner) {
+            ++conn->pending[1 + i];
+        }
+        if (1 == winner) {
+            __sync_fetch_and_add(&d->won, 1);
+        }
+    }
+    /**
+     * When the replica won, the primary latency is unknown but above the
+     * threshold, hence above the percentile: the elapsed time stands for it
+     * as well (only which side of the percentile it lies matters).
+     **/
+    if (winner >= 0) {
+        _redis_hedge_observe(d, VTIM_mono() - start);
+    }
+
+    return winner >= 0 ? r : NULL;
+}
+
+static int _redis_reply_to_string(struct ws *ws, redisReply *r, int *output_type, char **output_value)
+{
+    int ret;
+
+    ret = 1;
+    if (NULL != r) {
         switch (*output_type = r->type) {
             case REDIS_REPLY_NIL:
                 *output_value = NULL;
@@ -115,26 +628,167 @@ static int _redis_do_string_command(struct ws *ws, void *c, int *output_type, ch
                *output_value = NULL;
                 break;
         }
+        freeReplyObject(r);
     } else {
         ret = 0;
         *output_value = NULL;
     }
-    freeReplyObject(r);
 
     return ret;
 }
 
+static int _redis_get_string_reply(struct ws *ws, redisContext *ctxt, int *output_type, char **output_value)
+{
+    redisReply *r;
+
+    if (REDIS_OK != redisGetReply(ctxt, (void **) &r)) {
+        r = NULL;
+    }
+
+    return _redis_reply_to_string(ws, r, output_type, output_value);
+}
+
+static int _redis_do_string_command(struct ws *ws, void *c, int *output_type, char **output_value, const char *command, ...)
+{
+    va_list ap;
+    redisContext *ctxt;
+    struct vmod_keystore_redis_data_t *d;
+
+    d = (struct vmod_keystore_redis_data_t *) c;
+    CHECK_OBJ_NOTNULL(d, REDIS_MAGIC);
+    va_start(ap, command);
+    ctxt = _redis_get_context(d);
+//     r = redisvCommand(ctxt, command, ap);
+    redisvAppendCommand(ctxt, command, ap);
+    va_end(ap);
+
+    return _redis_get_string_reply(ws, ctxt, output_type, output_value);
+}
+
 static VCL_STRING vmod_keystore_redis_get(struct ws *ws, void *c, VCL_STRING key)
 {
+    int otype;
     char *ovalue;
-    int ret, otype;
+    redisReply *r;
+    struct vmod_keystore_redis_data_t *d;
 
-    ret = _redis_do_string_command(ws, c, &otype, &ovalue, "GET %s", key); /* nil when key does not exist */
-    AN(ret);
+    d = (struct vmod_keystore_redis_data_t *) c;
+    CHECK_OBJ_NOTNULL(d, REDIS_MAGIC);
+    if (NULL == (r = _redis_read_command(d, "GET %s", key))) {
+        VSL(SLT_Error, 0, "redis: failed to read '%s': no reply", key);
+        return NULL;
+    }
+    if (!_redis_reply_to_string(ws, r, &otype, &ovalue)) { /* nil when key does not exist */
+        VSL(SLT_Error, 0, "redis: failed to read '%s': %s", key, NULL == ovalue ? "error reply" : ovalue);
+        return NULL;
+    }
 
     return ovalue;
 }
 
+/* read the reply of a command sent for fetch, NULL (and logged) on error or unexpected type */
+static redisReply *_redis_fetch_reply(redisContext *ctxt, const char *key, int type)
+{
+    redisReply *r;
+
+    if (REDIS_OK != redisGetReply(ctxt, (void **) &r)) {
+        VSL(SLT_Error, 0, "redis: failed to read '%s': %s", key, ctxt->errstr);
+        return NULL;
+    }
+    AN(r);
+    if (type != r->type) {
+        VSL(SLT_Error, 0, "redis: failed to read '%s': %s", key, REDIS_REPLY_ERROR == r->type ? r->str : "unexpected reply");
+        freeReplyObject(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+static int vmod_keystore_redis_fetch(void *c, VCL_STRING key, int (*cb)(void *, const char *, size_t), void *cbarg)
+{
+    int ok, attempt;
+    redisReply *r;
+    redisContext *ctxt;
+    long long offset, length, chunk_len;
+    struct vmod_keystore_redis_data_t *d;
+
+    d = (struct vmod_keystore_redis_data_t *) c;
+    CHECK_OBJ_NOTNULL(d, REDIS_MAGIC);
+    ctxt = _redis_get_context(d);
+    /**
+     * the first chunk is read with a single GETRANGE: a short one is the
+     * whole value, as atomic as a GET. Larger values are read by chunks,
+     * which are not atomic with concurrent writes, so the length is
+     * checked before and after and the read is restarted if it changed
+     **/
+    for (attempt = 0; attempt < REDIS_FETCH_ATTEMPTS; attempt++) {
+        if (attempt > 0) {
+            cb(cbarg, NULL, 0);
+        }
+        redisAppendCommand(ctxt, "GETRANGE %s 0 %lld", key, (long long) REDIS_FETCH_CHUNK - 1);
+        if (NULL == (r = _redis_fetch_reply(ctxt, key, REDIS_REPLY_STRING))) {
+            return -1;
+        }
+        if (0 == r->len) {
+            freeReplyObject(r);
+            /* GETRANGE gives an empty string for a missing key as for an empty value */
+            redisAppendCommand(ctxt, "EXISTS %s", key);
+            if (NULL == (r = _redis_fetch_reply(ctxt, key, REDIS_REPLY_INTEGER))) {
+                return -1;
+            }
+            ok = 1 == r->integer;
+            freeReplyObject(r);
+            return ok;
+        }
+        if (!cb(cbarg, r->str, r->len)) {
+            freeReplyObject(r);
+            return -1;
+        }
+        chunk_len = (long long) r->len;
+        freeReplyObject(r);
+        if (chunk_len < REDIS_FETCH_CHUNK) {
+            return 1;
+        }
+        redisAppendCommand(ctxt, "STRLEN %s", key);
+        if (NULL == (r = _redis_fetch_reply(ctxt, key, REDIS_REPLY_INTEGER))) {
+            return -1;
+        }
+        length = r->integer;
+        freeReplyObject(r);
+        /* a value shorter than the first chunk was written since */
+        ok = length >= REDIS_FETCH_CHUNK;
+        for (offset = REDIS_FETCH_CHUNK; ok && offset < length; offset += REDIS_FETCH_CHUNK) {
+            chunk_len = length - offset < REDIS_FETCH_CHUNK ? length - offset : REDIS_FETCH_CHUNK;
+            redisAppendCommand(ctxt, "GETRANGE %s %lld %lld", key, offset, offset + chunk_len - 1);
+            if (NULL == (r = _redis_fetch_reply(ctxt, key, REDIS_REPLY_STRING))) {
+                return -1;
+            }
+            /* a shorter chunk means the value changed since STRLEN */
+            ok = (long long) r->len == chunk_len;
+            if (ok && !cb(cbarg, r->str, r->len)) {
+                freeReplyObject(r);
+                return -1;
+            }
+            freeReplyObject(r);
+        }
+        if (ok) {
+            redisAppendCommand(ctxt, "STRLEN %s", key);
+            if (NULL == (r = _redis_fetch_reply(ctxt, key, REDIS_REPLY_INTEGER))) {
+                return -1;
+            }
+            ok = r->integer == length;
+            freeReplyObject(r);
+        }
+        if (ok) {
+            return 1;
+        }
+    }
+    VSL(SLT_Error, 0, "redis: value of '%s' kept changing while being read", key);
+
+    return -1;
+}
+
 static int _redis_do_int_command(void *c, int *output_type, void *output_value, const char *command, ...)
 {
     int ret;
@@ -147,11 +801,7 @@ static int _redis_do_int_command(void *c, int *output_type, void *output_value,
     CHECK_OBJ_NOTNULL(d, REDIS_MAGIC);
     ret = 1;
     va_start(ap, command);
-    if (NULL == (ctxt = (redisContext *) pthread_getspecific(key))) {
-        ctxt = _redis_do_connect(d);
-        AN(ctxt);
-        pthread_setspecific(key, ctxt);
-    }
+    ctxt = _redis_get_context(d);
 //     r = redisvCommand(ctxt, command, ap);
     redisvAppendCommand(ctxt, command, ap);
     va_end(ap);
@@ -205,11 +855,23 @@ static VCL_VOID vmod_keystore_redis_set(void *c, VCL_STRING key, VCL_STRING valu
 
 static VCL_BOOL vmod_keystore_redis_exists(void *c, VCL_STRING key)
 {
-    int ret, otype, ovalue;
+    int ovalue;
+    redisReply *r;
+    struct vmod_keystore_redis_data_t *d;
 
-    ret = _redis_do_int_command(c, &otype, &ovalue, "EXISTS %s", key);
-    AN(ret);
-    AN(REDIS_REPLY_INTEGER == otype);
+    d = (struct vmod_keystore_redis_data_t *) c;
+    CHECK_OBJ_NOTNULL(d, REDIS_MAGIC);
+    if (NULL == (r = _redis_read_command(d, "EXISTS %s", key))) {
+        VSL(SLT_Error, 0, "redis: failed to check '%s': no reply", key);
+        return 0;
+    }
+    if (REDIS_REPLY_INTEGER != r->type) {
+        VSL(SLT_Error, 0, "redis: failed to check '%s': %s", key, REDIS_REPLY_ERROR == r->type ? r->str : "unexpected reply");
+        freeReplyObject(r);
+        return 0;
+    }
+    ovalue = 1 == r->integer;
+    freeReplyObject(r);
 
     return ovalue;
 }
@@ -256,6 +918,32 @@ static VCL_INT vmod_keystore_redis_decrement(void *c, VCL_STRING key)
     return ovalue;
 }
 
+static VCL_VOID vmod_keystore_redis_increment_by(void *c, size_t count, const char * const *keys, const VCL_INT *deltas)
+{
+    size_t i;
+    redisReply *r;
+    redisContext *ctxt;
+    struct vmod_keystore_redis_data_t *d;
+
+    d = (struct vmod_keystore_redis_data_t *) c;
+    CHECK_OBJ_NOTNULL(d, REDIS_MAGIC);
+    ctxt = _redis_get_context(d);
+    /* pipeline them: one round trip for all keys */
+    for (i = 0; i < count; i++) {
+        redisAppendCommand(ctxt, "INCRBY %s %lld", keys[i], (long long) deltas[i]);
+    }
+    for (i = 0; i < count; i++) {
+        if (REDIS_OK != redisGetReply(ctxt, (void **) &r)) {
+            VSL(SLT_Error, 0, "redis: %zu counters dropped: %s", count - i, ctxt->errstr);
+            break;
+        }
+        if (REDIS_REPLY_ERROR == r->type) {
+            VSL(SLT_Error, 0, "redis: counter '%s' dropped: %s", keys[i], r->str);
+        }
+        freeReplyObject(r);
+    }
+}
+
 static VCL_STRING vmod_keystore_redis_raw(struct ws *ws, void *c, VCL_STRING cmd)
 {
     char *ovalue;
@@ -267,6 +955,38 @@ static VCL_STRING vmod_keystore_redis_raw(struct ws *ws, void *c, VCL_STRING cmd
     return ovalue;
 }
 
+static VCL_STRING vmod_keystore_redis_command(struct ws *ws, void *c, int argc, const char **argv, const size_t *argvlen)
+{
+    int otype;
+    char *ovalue;
+    redisContext *ctxt;
+    struct vmod_keystore_redis_data_t *d;
+
+    d = (struct vmod_keystore_redis_data_t *) c;
+    CHECK_OBJ_NOTNULL(d, REDIS_MAGIC);
+    ctxt = _redis_get_context(d);
+    redisAppendCommandArgv(ctxt, argc, argv, argvlen);
+    /* an error reply is returned as the result */
+    _redis_get_string_reply(ws, ctxt, &otype, &ovalue);
+
+    return ovalue;
+}
+
+static VCL_STRING vmod_keystore_redis_stats(struct ws *ws, void *c)
+{
+    VCL_STRING stats;
+    struct vmod_keystore_redis_data_t *d;
+
+    d = (struct vmod_keystore_redis_data_t *) c;
+    CHECK_OBJ_NOTNULL(d, REDIS_MAGIC);
+    stats = WS_Printf(
+        ws, "reads=%lu;hedged=%lu;won=%lu;threshold=%.6f",
+        __sync_fetch_and_add(&d->reads, 0), __sync_fetch_and_add(&d->hedged, 0), __sync_fetch_and_add(&d->won, 0), _redis_hedge_threshold(d)
+    );
+
+    return stats;
+}
+
 #ifdef REDIS_SHARED_DRIVER
 static
 #endif /* REDIS_SHARED_DRIVER */
@@ -282,13 +1002,17 @@ const vmod_keystore_driver_imp redis_driver = {
     vmod_keystore_redis_expire,
     vmod_keystore_redis_increment,
     vmod_keystore_redis_decrement,
-    vmod_keystore_redis_raw
+    vmod_keystore_redis_raw,
+    vmod_keystore_redis_increment_by,
+    vmod_keystore_redis_fetch,
+    vmod_keystore_redis_command,
+    vmod_keystore_redis_configure,
+    vmod_keystore_redis_stats
 };
 
 #ifdef REDIS_SHARED_DRIVER
 int init_function(struct vmod_priv *priv, const struct VCL_conf *cfg)
 {
-    pthread_once(&key_once, make_key);
     vmod_keystore_register_driver(&redis_driver);
 
     return 0;
@@ -32,8 +32,23 @@ typedef struct {
     VCL_INT (*increment)(void *, VCL_STRING);
     VCL_INT (*decrement)(void *, VCL_STRING);
     VCL_STRING (*raw)(struct ws *, void *, VCL_STRING);
+    /* apply count deltas (may be negative) to count keys at once */
+    VCL_VOID (*increment_by)(void *, size_t, const char * const *, const VCL_INT *);
+    /**
+     * hand the value to the callback, in one or more chunks, without copying it to the workspace
+     * (a NULL chunk discards the ones given so far) ; returns 1 if found, 0 if not, -1 on error
+     **/
+    int (*fetch)(void *, VCL_STRING, int (*)(void *, const char *, size_t), void *);
+    /* as raw but with an already splitted command (argc, argv, argvlen) */
+    VCL_STRING (*command)(struct ws *, void *, int, const char **, const size_t *);
+    /* receive a DSN parameter unknown to keystore (name, value) ; returns 0 if the driver doesn't know it either */
+    int (*configure)(void *, const char *, const char *);
+    /* driver specific statistics, NULL if none */
+    VCL_STRING (*stats)(struct ws *, void *);
 } vmod_keystore_driver_imp;
 
 void vmod_keystore_register_driver(const vmod_keystore_driver_imp * const);
+/* parse a duration (\d+(?:\.\d+)?s? or \d+ms) ; returns 0 if invalid */
+int vmod_keystore_parse_tv(const char *, struct timeval *);
 
 #endif /* !KEY_STORE_DRIVER_H */
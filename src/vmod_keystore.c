@@ -1,16 +1,165 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "vrt.h"
+#include "vtim.h"
+#include "vsb.h"
 #include "cache/cache.h"
 #include "vcc_if.h"
 #include "keystore_driver.h"
 
+#define COUNTER_SHARDS 16
+#define COUNTER_BUCKETS 64
+#define COUNTER_DEFAULT_INTERVAL 1.0
+#define COUNTER_DEFAULT_THRESHOLD 1024
+
+struct vmod_keystore_counter {
+    char *key;
+    unsigned int hash;
+    VCL_INT delta;
+    struct vmod_keystore_counter *next;
+};
+
+struct vmod_keystore_counter_shard {
+    pthread_mutex_t mtx;
+    size_t pending;
+    struct vmod_keystore_counter *buckets[COUNTER_BUCKETS];
+};
+
+/**
+ * Deltas given to .count() are summed locally, in a shard picked from the
+ * calling thread (to limit contention), and pushed to the store by a
+ * background thread, at most every interval seconds or as soon as the
+ * shards hold threshold entries (a key counted by several threads has an
+ * entry in each of their shards)
+ **/
+struct vmod_keystore_counters {
+    int running;
+    size_t pending;
+    int stopping;
+    double interval;
+    size_t threshold;
+    pthread_t flusher;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    struct vmod_keystore_counter_shard shards[COUNTER_SHARDS];
+};
+
+#define HOTKEYS_DEFAULT_SIZE 16
+#define HOTKEYS_DEFAULT_SAMPLE 64
+#define HOTKEYS_HALF_LIFE 1.0
+
+struct vmod_keystore_hotkey {
+    char *key;
+    unsigned int hash;
+    double count;
+    double error;
+    char *value;
+    double expires;
+};
+
+/**
+ * Space-Saving top-K of the keys read by .get(), fed by 1 read out of
+ * sample (per thread). Counts decay continuously, halving every
+ * HOTKEYS_HALF_LIFE seconds, so they reflect the current rate rather than
+ * the whole history.
+ * If ttl is set, keys read more than rate times per second are served
+ * from a local copy for at most ttl seconds.
+ **/
+struct vmod_keystore_hotkeys {
+    size_t size;
+    unsigned int sample;
+    double ttl;
+    double rate;
+    double last_decay;
+    unsigned long generation;
+    pthread_rwlock_t lock;
+    struct vmod_keystore_hotkey *slots;
+};
+
+/**
+ * Connections are shared, across VCLs, by all driver objects with the same
+ * normalized DSN and closed when the last of them is discarded: a reload
+ * does not have to reconnect to the store
+ **/
+struct vmod_keystore_connection {
+    unsigned magic;
+#define CONNECTION_MAGIC 0x2266feff
+    unsigned refcnt;
+    char *dsn;
+    const vmod_keystore_driver_imp *driver;
+    void *private;
+    VTAILQ_ENTRY(vmod_keystore_connection) list;
+};
+
+#define COMMAND_MAX_ARGS 32
+#define COMMAND_ARG_BUFFER_SIZE 32
+#define COMMAND_BINDING_BUCKETS 64
+#define COMMAND_MAX_BINDINGS 16 /* per bucket */
+
+enum {
+    COMMAND_ARG_LITERAL,
+    COMMAND_ARG_INT,
+    COMMAND_ARG_STRING,
+    COMMAND_ARG_DURATION
+};
+
+/**
+ * A command template parsed once by .prepare(): each word is either a
+ * literal or a slot (%d, %s, %t) filled, in order, by the values given to
+ * .bind_int/.bind_string/.bind_duration before .exec()
+ **/
+struct vmod_keystore_command {
+    unsigned magic;
+#define COMMAND_MAGIC 0x5566feff
+    char *name;
+    int argc;
+    int slots;
+    int types[COMMAND_MAX_ARGS];
+    char *literals[COMMAND_MAX_ARGS];
+    VTAILQ_ENTRY(vmod_keystore_command) list;
+};
+
+/**
+ * Values (copied) bound, to a driver object, by a task: Varnish 4 has no
+ * per task storage for vmods (PRIV_TASK) and a task may change of thread
+ * between a bind and its exec. A task is identified by its req (or
+ * busyobj) and its VSL id, and hashed on the first: these are recycled,
+ * so the values of a task which never called exec are dropped as soon
+ * as a new task binds with the same req (or busyobj)
+ **/
+struct vmod_keystore_binding {
+    unsigned magic;
+#define BINDING_MAGIC 0x6666feff
+    const void *task;
+    unsigned owner;
+    int count;
+    struct {
+        int type;
+        char *value;
+    } args[COMMAND_MAX_ARGS];
+    VTAILQ_ENTRY(vmod_keystore_binding) list;
+};
+
+struct vmod_keystore_bindings {
+    pthread_mutex_t mtx;
+    unsigned int count;
+    VTAILQ_HEAD(vmod_keystore_binding_head, vmod_keystore_binding) list;
+};
+
 struct vmod_keystore_driver {
     unsigned magic;
 #define VMOD_STORE_OBJ_MAGIC 0x3366feff
     const vmod_keystore_driver_imp *driver;
     void *private;
+    struct vmod_keystore_connection *connection;
+    struct vmod_keystore_counters counters;
+    struct vmod_keystore_hotkeys hotkeys;
+    VTAILQ_HEAD(, vmod_keystore_command) commands;
+    struct vmod_keystore_bindings bindings[COMMAND_BINDING_BUCKETS];
 };
 
 struct vmod_keystore_registered_driver {
@@ -22,6 +171,9 @@ struct vmod_keystore_registered_driver {
 
 static VTAILQ_HEAD(, vmod_keystore_registered_driver) drivers = VTAILQ_HEAD_INITIALIZER(drivers);
 
+static pthread_mutex_t connections_mtx = PTHREAD_MUTEX_INITIALIZER;
+static VTAILQ_HEAD(, vmod_keystore_connection) connections = VTAILQ_HEAD_INITIALIZER(connections);
+
 void vmod_keystore_register_driver(const vmod_keystore_driver_imp * const driver)
 {
     struct vmod_keystore_registered_driver *d;
@@ -33,7 +185,7 @@ void vmod_keystore_register_driver(const vmod_keystore_driver_imp * const driver
 }
 
 #include <math.h>
-static int parse_tv(const char *string, struct timeval *tv)
+int vmod_keystore_parse_tv(const char *string, struct timeval *tv)
 {
     double d;
     char *endptr;
@@ -46,22 +198,29 @@ static int parse_tv(const char *string, struct timeval *tv)
         return 0;
     }
     d = strtod(string, &endptr);
-    if (!isfinite(d)) {
+    if (endptr == string || !isfinite(d)) {
         return 0;
     }
     while (' ' == *string) {
         ++string;
     }
     switch (*endptr) {
-        case '\0':
         case 's':
+            if ('\0' != endptr[1] && ';' != endptr[1]) {
+                return 0;
+            }
+            /* no break here */
+        case '\0':
+        case ';':
             tv->tv_sec = (long int) d;
             tv->tv_usec = (long int) ((d - (double) tv->tv_sec) * 1000000.0);
             break;
         case 'm':
-            if ('\0' != *endptr && 's' == ++*endptr) {
-                tv->tv_usec = (long int) d;
+            if ('s' != endptr[1] || ('\0' != endptr[2] && ';' != endptr[2])) {
+                return 0;
             }
+            tv->tv_sec = (long int) (d / 1000.0);
+            tv->tv_usec = (long int) ((d - (double) tv->tv_sec * 1000.0) * 1000.0);
             break;
         default:
             return 0;
@@ -93,11 +252,616 @@ static int strcmp_l(
     return str1_len - str2_len;
 }
 
+static unsigned int hash_key(const char *key)
+{
+    unsigned int h;
+
+    /* FNV-1a */
+    h = 2166136261U;
+    while ('\0' != *key) {
+        h ^= (unsigned char) *key++;
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+static unsigned int thread_shard(void)
+{
+    uintptr_t id;
+
+    /* pthread_t is an address or an integer depending on the system, mix its bits */
+    id = (uintptr_t) pthread_self();
+    id ^= id >> 12;
+    id ^= id >> 4;
+
+    return (unsigned int) (id % COUNTER_SHARDS);
+}
+
+static void counters_init(struct vmod_keystore_counters *counters)
+{
+    size_t i;
+
+    memset(counters, 0, sizeof(*counters));
+    counters->interval = COUNTER_DEFAULT_INTERVAL;
+    counters->threshold = COUNTER_DEFAULT_THRESHOLD;
+    AZ(pthread_mutex_init(&counters->mtx, NULL));
+    AZ(pthread_cond_init(&counters->cond, NULL));
+    for (i = 0; i < COUNTER_SHARDS; i++) {
+        AZ(pthread_mutex_init(&counters->shards[i].mtx, NULL));
+    }
+}
+
+static void counters_flush(struct vmod_keystore_driver *p)
+{
+    size_t i, j, count;
+    VCL_INT *deltas;
+    const char **keys;
+    struct vmod_keystore_counter *merged[COUNTER_BUCKETS], *taken[COUNTER_BUCKETS], *c, *m, *next;
+
+    count = 0;
+    memset(merged, 0, sizeof(merged));
+    for (i = 0; i < COUNTER_SHARDS; i++) {
+        struct vmod_keystore_counter_shard *shard;
+
+        shard = &p->counters.shards[i];
+        AZ(pthread_mutex_lock(&shard->mtx));
+        memcpy(taken, shard->buckets, sizeof(taken));
+        memset(shard->buckets, 0, sizeof(shard->buckets));
+        (void) __sync_sub_and_fetch(&p->counters.pending, shard->pending);
+        shard->pending = 0;
+        AZ(pthread_mutex_unlock(&shard->mtx));
+        /* same key may have been counted by several threads, sum them */
+        for (j = 0; j < COUNTER_BUCKETS; j++) {
+            for (c = taken[j]; NULL != c; c = next) {
+                next = c->next;
+                for (m = merged[j]; NULL != m; m = m->next) {
+                    if (m->hash == c->hash && 0 == strcmp(m->key, c->key)) {
+                        break;
+                    }
+                }
+                if (NULL == m) {
+                    c->next = merged[j];
+                    merged[j] = c;
+                    ++count;
+                } else {
+                    m->delta += c->delta;
+                    free(c->key);
+                    free(c);
+                }
+            }
+        }
+    }
+    if (0 == count) {
+        return;
+    }
+    keys = malloc(sizeof(*keys) * count);
+    AN(keys);
+    deltas = malloc(sizeof(*deltas) * count);
+    AN(deltas);
+    count = 0;
+    for (j = 0; j < COUNTER_BUCKETS; j++) {
+        for (c = merged[j]; NULL != c; c = c->next) {
+            if (0 != c->delta) {
+                keys[count] = c->key;
+                deltas[count] = c->delta;
+                ++count;
+            }
+        }
+    }
+    if (count > 0) {
+        p->driver->increment_by(p->private, count, keys, deltas);
+    }
+    free(keys);
+    free(deltas);
+    for (j = 0; j < COUNTER_BUCKETS; j++) {
+        for (c = merged[j]; NULL != c; c = next) {
+            next = c->next;
+            free(c->key);
+            free(c);
+        }
+    }
+}
+
+static void *counters_flusher(void *arg)
+{
+    struct timespec ts;
+    struct vmod_keystore_driver *p;
+
+    p = (struct vmod_keystore_driver *) arg;
+    CHECK_OBJ_NOTNULL(p, VMOD_STORE_OBJ_MAGIC);
+    AZ(pthread_mutex_lock(&p->counters.mtx));
+    while (!p->counters.stopping) {
+        AZ(clock_gettime(CLOCK_REALTIME, &ts));
+        ts.tv_sec += (time_t) p->counters.interval;
+        ts.tv_nsec += (long) ((p->counters.interval - (double) (time_t) p->counters.interval) * 1e9);
+        if (ts.tv_nsec >= 1000000000L) {
+            ++ts.tv_sec;
+            ts.tv_nsec -= 1000000000L;
+        }
+        (void) pthread_cond_timedwait(&p->counters.cond, &p->counters.mtx, &ts);
+        if (p->counters.stopping) {
+            break;
+        }
+        AZ(pthread_mutex_unlock(&p->counters.mtx));
+        counters_flush(p);
+        AZ(pthread_mutex_lock(&p->counters.mtx));
+    }
+    AZ(pthread_mutex_unlock(&p->counters.mtx));
+
+    return NULL;
+}
+
+static void counters_fini(struct vmod_keystore_driver *p)
+{
+    size_t i;
+
+    AZ(pthread_mutex_lock(&p->counters.mtx));
+    p->counters.stopping = 1;
+    AZ(pthread_cond_signal(&p->counters.cond));
+    AZ(pthread_mutex_unlock(&p->counters.mtx));
+    if (p->counters.running) {
+        AZ(pthread_join(p->counters.flusher, NULL));
+    }
+    /* push what was counted since last flush */
+    counters_flush(p);
+    for (i = 0; i < COUNTER_SHARDS; i++) {
+        AZ(pthread_mutex_destroy(&p->counters.shards[i].mtx));
+    }
+    AZ(pthread_cond_destroy(&p->counters.cond));
+    AZ(pthread_mutex_destroy(&p->counters.mtx));
+}
+
+static __thread unsigned int hotkeys_tick;
+
+static void hotkeys_init(struct vmod_keystore_hotkeys *hotkeys, size_t size, unsigned int sample, double ttl, double rate)
+{
+    memset(hotkeys, 0, sizeof(*hotkeys));
+    hotkeys->size = size;
+    hotkeys->sample = 0 == sample ? 1 : sample;
+    hotkeys->ttl = ttl;
+    hotkeys->rate = rate;
+    hotkeys->last_decay = VTIM_mono();
+    AZ(pthread_rwlock_init(&hotkeys->lock, NULL));
+    if (size > 0) {
+        hotkeys->slots = calloc(size, sizeof(*hotkeys->slots));
+        AN(hotkeys->slots);
+    }
+}
+
+static void hotkeys_fini(struct vmod_keystore_hotkeys *hotkeys)
+{
+    size_t i;
+
+    for (i = 0; i < hotkeys->size; i++) {
+        free(hotkeys->slots[i].key);
+        free(hotkeys->slots[i].value);
+    }
+    free(hotkeys->slots);
+    AZ(pthread_rwlock_destroy(&hotkeys->lock));
+}
+
+/* caller must hold the lock */
+static struct vmod_keystore_hotkey *hotkeys_find(struct vmod_keystore_hotkeys *hotkeys, const char *key, unsigned int hash)
+{
+    size_t i;
+
+    for (i = 0; i < hotkeys->size; i++) {
+        if (NULL != hotkeys->slots[i].key && hotkeys->slots[i].hash == hash && 0 == strcmp(hotkeys->slots[i].key, key)) {
+            return &hotkeys->slots[i];
+        }
+    }
+
+    return NULL;
+}
+
+static int hotkeys_sampled(struct vmod_keystore_hotkeys *hotkeys)
+{
+    return hotkeys->size > 0 && 0 == ++hotkeys_tick % hotkeys->sample;
+}
+
+/**
+ * estimated reads per second of a slot at now: a steady rate r gives a
+ * count of r * HOTKEYS_HALF_LIFE / ln 2 (the integral of the decay)
+ **/
+static double hotkeys_rate(struct vmod_keystore_hotkeys *hotkeys, struct vmod_keystore_hotkey *h, double now)
+{
+    return h->count * pow(2.0, -(now - hotkeys->last_decay) / HOTKEYS_HALF_LIFE) * hotkeys->sample * M_LN2 / HOTKEYS_HALF_LIFE;
+}
+
+static const char *hotkeys_lookup(struct ws *ws, struct vmod_keystore_hotkeys *hotkeys, const char *key)
+{
+    const char *value;
+    struct vmod_keystore_hotkey *h;
+
+    value = NULL;
+    AZ(pthread_rwlock_rdlock(&hotkeys->lock));
+    if (NULL != (h = hotkeys_find(hotkeys, key, hash_key(key))) && NULL != h->value && h->expires > VTIM_mono()) {
+        value = WS_Copy(ws, h->value, -1);
+    }
+    AZ(pthread_rwlock_unlock(&hotkeys->lock));
+
+    return value;
+}
+
+/* generation is the one read before fetching value: a write since then forbids to keep it ; value is NULL to only count a read */
+static void hotkeys_track(struct vmod_keystore_hotkeys *hotkeys, const char *key, const char *value, unsigned long generation)
+{
+    size_t i;
+    double now, factor;
+    unsigned int hash;
+    struct vmod_keystore_hotkey *h, *min;
+
+    now = VTIM_mono();
+    hash = hash_key(key);
+    AZ(pthread_rwlock_wrlock(&hotkeys->lock));
+    factor = pow(2.0, -(now - hotkeys->last_decay) / HOTKEYS_HALF_LIFE);
+    for (i = 0; i < hotkeys->size; i++) {
+        hotkeys->slots[i].count *= factor;
+        hotkeys->slots[i].error *= factor;
+    }
+    hotkeys->last_decay = now;
+    if (NULL == (h = hotkeys_find(hotkeys, key, hash))) {
+        /* take a free slot or evict the least counted one, inheriting its count as error */
+        min = &hotkeys->slots[0];
+        for (i = 0; i < hotkeys->size; i++) {
+            if (NULL == hotkeys->slots[i].key) {
+                min = &hotkeys->slots[i];
+                break;
+            }
+            if (hotkeys->slots[i].count < min->count) {
+                min = &hotkeys->slots[i];
+            }
+        }
+        h = min;
+        free(h->key);
+        free(h->value);
+        h->key = strdup(key);
+        AN(h->key);
+        h->hash = hash;
+        h->error = h->count;
+        h->value = NULL;
+    }
+    h->count += 1;
+    if (hotkeys->ttl > 0 && NULL != value && generation == hotkeys->generation && hotkeys_rate(hotkeys, h, now) >= hotkeys->rate && (NULL == h->value || h->expires <= now)) {
+        free(h->value);
+        h->value = strdup(value);
+        AN(h->value);
+        h->expires = now + hotkeys->ttl;
+    }
+    AZ(pthread_rwlock_unlock(&hotkeys->lock));
+}
+
+static void hotkeys_invalidate(struct vmod_keystore_hotkeys *hotkeys, const char *key)
+{
+    struct vmod_keystore_hotkey *h;
+
+    if (hotkeys->ttl <= 0 || NULL == key) {
+        return;
+    }
+    AZ(pthread_rwlock_wrlock(&hotkeys->lock));
+    ++hotkeys->generation;
+    if (NULL != (h = hotkeys_find(hotkeys, key, hash_key(key)))) {
+        free(h->value);
+        h->value = NULL;
+    }
+    AZ(pthread_rwlock_unlock(&hotkeys->lock));
+}
+
+static void connection_configure(const struct vrt_ctx *ctx, struct vmod_keystore_connection *c, const char *options)
+{
+    char *name, *value, *end;
+
+    while ('\0' != *options) {
+        if (NULL == (end = strchr(options, ';'))) {
+            end = (char *) options + strlen(options);
+        }
+        name = strndup(options, end - options);
+        AN(name);
+        if (NULL != (value = strchr(name, '='))) {
+            *value++ = '\0';
+            if (NULL == c->driver->configure || !c->driver->configure(c->private, name, value)) {
+                VSLb(ctx->vsl, SLT_Error, "unknown parameter or invalid value '%s=%s' for driver '%s'", name, value, c->driver->name);
+            }
+        }
+        free(name);
+        options = '\0' == *end ? end : end + 1;
+    }
+}
+
+static int options_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* returns a copy of options ("name=value;...") sorted by name, to be freed */
+static char *options_sort(const char *options)
+{
+    size_t i, count;
+    char *copy, *sorted, *ptr, *last, **list;
+
+    copy = strdup(options);
+    AN(copy);
+    count = 1;
+    for (ptr = copy; '\0' != *ptr; ptr++) {
+        if (';' == *ptr) {
+            ++count;
+        }
+    }
+    list = malloc(sizeof(*list) * count);
+    AN(list);
+    count = 0;
+    for (ptr = strtok_r(copy, ";", &last); NULL != ptr; ptr = strtok_r(NULL, ";", &last)) {
+        list[count++] = ptr;
+    }
+    qsort(list, count, sizeof(*list), options_cmp);
+    sorted = malloc(strlen(options) + 1);
+    AN(sorted);
+    *sorted = '\0';
+    for (i = 0; i < count; i++) {
+        if (0 != i) {
+            strcat(sorted, ";");
+        }
+        strcat(sorted, list[i]);
+    }
+    free(list);
+    free(copy);
+
+    return sorted;
+}
+
+static struct vmod_keystore_connection *connection_acquire(const struct vrt_ctx *ctx, const vmod_keystore_driver_imp *driver, const char *host, int port, struct timeval tv, const char *options)
+{
+    struct vsb *vsb;
+    char *sorted_options;
+    struct vmod_keystore_connection *c;
+
+    vsb = VSB_new_auto();
+    AN(vsb);
+    VSB_printf(vsb, "%s:host=%s;port=%d;timeout=%ld.%06ld", driver->name, host, port, (long) tv.tv_sec, (long) tv.tv_usec);
+    /* driver specific parameters change the connection too */
+    sorted_options = options_sort(options);
+    if ('\0' != *sorted_options) {
+        VSB_printf(vsb, ";%s", sorted_options);
+    }
+    AZ(VSB_finish(vsb));
+    AZ(pthread_mutex_lock(&connections_mtx));
+    VTAILQ_FOREACH(c, &connections, list) {
+        CHECK_OBJ(c, CONNECTION_MAGIC);
+        if (c->driver == driver && 0 == strcmp(c->dsn, VSB_data(vsb))) {
+            break;
+        }
+    }
+    if (NULL == c) {
+        ALLOC_OBJ(c, CONNECTION_MAGIC);
+        AN(c);
+        c->driver = driver;
+        c->dsn = strdup(VSB_data(vsb));
+        AN(c->dsn);
+        c->private = driver->open(host, port, tv);
+        XXXAN(c->private);
+        connection_configure(ctx, c, sorted_options);
+        VTAILQ_INSERT_TAIL(&connections, c, list);
+    }
+    ++c->refcnt;
+    AZ(pthread_mutex_unlock(&connections_mtx));
+    VSB_delete(vsb);
+    free(sorted_options);
+
+    return c;
+}
+
+static void connection_release(struct vmod_keystore_connection *c)
+{
+    CHECK_OBJ_NOTNULL(c, CONNECTION_MAGIC);
+    AZ(pthread_mutex_lock(&connections_mtx));
+    assert(c->refcnt > 0);
+    if (0 == --c->refcnt) {
+        VTAILQ_REMOVE(&connections, c, list);
+        c->driver->close(c->private);
+        free(c->dsn);
+        FREE_OBJ(c);
+    }
+    AZ(pthread_mutex_unlock(&connections_mtx));
+}
+
+static void binding_free(struct vmod_keystore_binding *b)
+{
+    int i;
+
+    CHECK_OBJ_NOTNULL(b, BINDING_MAGIC);
+    for (i = 0; i < b->count; i++) {
+        free(b->args[i].value);
+    }
+    FREE_OBJ(b);
+}
+
+static void commands_fini(struct vmod_keystore_driver *p)
+{
+    int i;
+    struct vmod_keystore_command *c;
+    struct vmod_keystore_binding *b;
+
+    while (NULL != (c = VTAILQ_FIRST(&p->commands))) {
+        CHECK_OBJ(c, COMMAND_MAGIC);
+        VTAILQ_REMOVE(&p->commands, c, list);
+        for (i = 0; i < c->argc; i++) {
+            free(c->literals[i]);
+        }
+        free(c->name);
+        FREE_OBJ(c);
+    }
+    for (i = 0; i < COMMAND_BINDING_BUCKETS; i++) {
+        while (NULL != (b = VTAILQ_FIRST(&p->bindings[i].list))) {
+            VTAILQ_REMOVE(&p->bindings[i].list, b, list);
+            binding_free(b);
+        }
+        AZ(pthread_mutex_destroy(&p->bindings[i].mtx));
+    }
+}
+
+static int command_parse(struct vmod_keystore_command *c, const char *template)
+{
+    const char *start, *end;
+
+    c->argc = c->slots = 0;
+    for (start = template; '\0' != *start; start = end) {
+        while (' ' == *start || '\t' == *start) {
+            ++start;
+        }
+        if ('\0' == *start) {
+            break;
+        }
+        for (end = start; '\0' != *end && ' ' != *end && '\t' != *end; end++)
+            ;
+        if (c->argc >= COMMAND_MAX_ARGS) {
+            return 0;
+        }
+        c->literals[c->argc] = NULL;
+        if ('%' == *start && 2 == end - start && '%' != start[1]) {
+            switch (start[1]) {
+                case 'd':
+                    c->types[c->argc] = COMMAND_ARG_INT;
+                    break;
+                case 's':
+                    c->types[c->argc] = COMMAND_ARG_STRING;
+                    break;
+                case 't':
+                    c->types[c->argc] = COMMAND_ARG_DURATION;
+                    break;
+                default:
+                    return 0;
+            }
+            ++c->slots;
+        } else {
+            const char *ptr;
+
+            /* %% at the start of a word stands for a literal % */
+            if ('%' == *start) {
+                if ('%' != start[1]) {
+                    return 0;
+                }
+                ++start;
+                ptr = start + 1;
+            } else {
+                ptr = start;
+            }
+            /* a placeholder only stands for a whole word, don't send it as is */
+            for (; ptr < end - 1; ptr++) {
+                if ('%' == ptr[0] && NULL != strchr("dst", ptr[1])) {
+                    return 0;
+                }
+            }
+            c->types[c->argc] = COMMAND_ARG_LITERAL;
+            c->literals[c->argc] = strndup(start, end - start);
+            AN(c->literals[c->argc]);
+        }
+        ++c->argc;
+    }
+
+    return c->argc > 0;
+}
+
+static const void *bind_task(const struct vrt_ctx *ctx)
+{
+    if (NULL != ctx->req) {
+        return ctx->req;
+    } else if (NULL != ctx->bo) {
+        return ctx->bo;
+    } else {
+        return ctx->vsl; /* vcl_init */
+    }
+}
+
+static struct vmod_keystore_bindings *bind_bucket(struct vmod_keystore_driver *p, const void *task)
+{
+    return &p->bindings[((uintptr_t) task >> 4) % COMMAND_BINDING_BUCKETS];
+}
+
+static void bind_next(const struct vrt_ctx *ctx, struct vmod_keystore_driver *p, int type, const char *value)
+{
+    const void *task;
+    struct vmod_keystore_bindings *bucket;
+    struct vmod_keystore_binding *b, *next, *stale;
+
+    AN(ctx->vsl);
+    stale = NULL;
+    task = bind_task(ctx);
+    bucket = bind_bucket(p, task);
+    AZ(pthread_mutex_lock(&bucket->mtx));
+    VTAILQ_FOREACH_SAFE(b, &bucket->list, list, next) {
+        CHECK_OBJ(b, BINDING_MAGIC);
+        if (b->task != task) {
+            continue;
+        }
+        if (b->owner == ctx->vsl->wid) {
+            break;
+        }
+        /* left by a previous task on the same req/busyobj */
+        VTAILQ_REMOVE(&bucket->list, b, list);
+        --bucket->count;
+        stale = b;
+    }
+    if (NULL == b) {
+        /* forget the oldest values, in case req/busyobj are not reused */
+        if (NULL == stale && bucket->count >= COMMAND_MAX_BINDINGS) {
+            stale = VTAILQ_LAST(&bucket->list, vmod_keystore_binding_head);
+            VTAILQ_REMOVE(&bucket->list, stale, list);
+            --bucket->count;
+        }
+        ALLOC_OBJ(b, BINDING_MAGIC);
+        AN(b);
+        b->task = task;
+        b->owner = ctx->vsl->wid;
+        VTAILQ_INSERT_HEAD(&bucket->list, b, list);
+        ++bucket->count;
+    }
+    if (b->count >= COMMAND_MAX_ARGS) {
+        AZ(pthread_mutex_unlock(&bucket->mtx));
+        VSLb(ctx->vsl, SLT_Error, "too many values bound (%d at most)", COMMAND_MAX_ARGS);
+    } else {
+        b->args[b->count].type = type;
+        b->args[b->count].value = strdup(NULL == value ? "" : value);
+        AN(b->args[b->count].value);
+        ++b->count;
+        AZ(pthread_mutex_unlock(&bucket->mtx));
+    }
+    if (NULL != stale) {
+        binding_free(stale);
+    }
+}
+
+/* detach the values bound by the current task, NULL if none */
+static struct vmod_keystore_binding *bind_take(const struct vrt_ctx *ctx, struct vmod_keystore_driver *p)
+{
+    const void *task;
+    struct vmod_keystore_bindings *bucket;
+    struct vmod_keystore_binding *b;
+
+    AN(ctx->vsl);
+    task = bind_task(ctx);
+    bucket = bind_bucket(p, task);
+    AZ(pthread_mutex_lock(&bucket->mtx));
+    VTAILQ_FOREACH(b, &bucket->list, list) {
+        CHECK_OBJ(b, BINDING_MAGIC);
+        if (b->task == task && b->owner == ctx->vsl->wid) {
+            VTAILQ_REMOVE(&bucket->list, b, list);
+            --bucket->count;
+            break;
+        }
+    }
+    AZ(pthread_mutex_unlock(&bucket->mtx));
+
+    return b;
+}
+
 VCL_VOID vmod_driver__init(const struct vrt_ctx *ctx, struct vmod_keystore_driver **pp, const char *vcl_name, VCL_STRING dsn)
 {
-    int port;
-    void *conn;
-    struct timeval tv;
+    int i, port;
+    struct vsb *options;
+    double hot_rate;
+    long threshold, hot_size, hot_sample;
+    struct timeval tv, interval, hot_ttl;
     struct vmod_keystore_driver *p;
     char *ptr, *host, *pname, *pvalue;
     struct vmod_keystore_registered_driver *d;
@@ -110,7 +874,15 @@ VCL_VOID vmod_driver__init(const struct vrt_ctx *ctx, struct vmod_keystore_drive
     port = -1;
     host = NULL;
     effective_driver = NULL;
+    threshold = 0;
+    hot_rate = 0;
+    hot_size = HOTKEYS_DEFAULT_SIZE;
+    hot_sample = HOTKEYS_DEFAULT_SAMPLE;
     memset(&tv, 0, sizeof(tv));
+    memset(&interval, 0, sizeof(interval));
+    memset(&hot_ttl, 0, sizeof(hot_ttl));
+    options = VSB_new_auto();
+    AN(options);
     if (NULL == (ptr = strchr(dsn, ':'))) {
         VSLb(ctx->vsl, SLT_Error, "no driver name found");
     }
@@ -142,12 +914,33 @@ VCL_VOID vmod_driver__init(const struct vrt_ctx *ctx, struct vmod_keystore_drive
                 }
 //                 debug("attr = >%.*s<, value = >%.*s<\n", pvalue - pname - 1 /* '=' */, pname, ptr - pvalue /*- ('\0' == *ptr ? 0 : 1)*/, pvalue);
                 if (0 == strcmp_l("host", STR_LEN("host"), pname, pvalue - pname - 1)) {
-                    host = malloc(sizeof(*host) * (ptr - pvalue + 1));
-                    strncpy(host, pvalue, ptr - pvalue);
+                    free(host);
+                    host = strndup(pvalue, ptr - pvalue);
+                    AN(host);
                 } else if (0 == strcmp_l("timeout", STR_LEN("timeout"), pname, pvalue - pname - 1)) {
-                    parse_tv(pvalue, &tv);
+                    if (!vmod_keystore_parse_tv(pvalue, &tv)) {
+                        VSLb(ctx->vsl, SLT_Error, "invalid duration for '%.*s', ignored", (int) (pvalue - pname - 1), pname);
+                    }
                 } else if (0 == strcmp_l("port", STR_LEN("port"), pname, pvalue - pname - 1)) {
                     port = atoi(pvalue);
+                } else if (0 == strcmp_l("flush_interval", STR_LEN("flush_interval"), pname, pvalue - pname - 1)) {
+                    if (!vmod_keystore_parse_tv(pvalue, &interval)) {
+                        VSLb(ctx->vsl, SLT_Error, "invalid duration for '%.*s', ignored", (int) (pvalue - pname - 1), pname);
+                    }
+                } else if (0 == strcmp_l("flush_threshold", STR_LEN("flush_threshold"), pname, pvalue - pname - 1)) {
+                    threshold = atol(pvalue);
+                } else if (0 == strcmp_l("hotkeys", STR_LEN("hotkeys"), pname, pvalue - pname - 1)) {
+                    hot_size = atol(pvalue);
+                } else if (0 == strcmp_l("hotkeys_sample", STR_LEN("hotkeys_sample"), pname, pvalue - pname - 1)) {
+                    hot_sample = atol(pvalue);
+                } else if (0 == strcmp_l("hotkeys_ttl", STR_LEN("hotkeys_ttl"), pname, pvalue - pname - 1)) {
+                    if (!vmod_keystore_parse_tv(pvalue, &hot_ttl)) {
+                        VSLb(ctx->vsl, SLT_Error, "invalid duration for '%.*s', ignored", (int) (pvalue - pname - 1), pname);
+                    }
+                } else if (0 == strcmp_l("hotkeys_rate", STR_LEN("hotkeys_rate"), pname, pvalue - pname - 1)) {
+                    hot_rate = strtod(pvalue, NULL);
+                } else {
+                    VSB_printf(options, "%s%.*s", 0 == VSB_len(options) ? "" : ";", (int) (ptr - pname), pname);
                 }
                 pname = ptr + 1;
             }
@@ -155,15 +948,35 @@ VCL_VOID vmod_driver__init(const struct vrt_ctx *ctx, struct vmod_keystore_drive
         }
     }
     XXXAN(host);
-    conn = effective_driver->open(host, port, tv);
-    free(host);
-    XXXAN(conn);
 
     ALLOC_OBJ(p, VMOD_STORE_OBJ_MAGIC);
     AN(p);
     *pp = p;
     p->driver = effective_driver;
-    p->private = conn;
+    AZ(VSB_finish(options));
+    p->connection = connection_acquire(ctx, effective_driver, host, port, tv, VSB_data(options));
+    p->private = p->connection->private;
+    VSB_delete(options);
+    free(host);
+    VTAILQ_INIT(&p->commands);
+    for (i = 0; i < COMMAND_BINDING_BUCKETS; i++) {
+        VTAILQ_INIT(&p->bindings[i].list);
+        AZ(pthread_mutex_init(&p->bindings[i].mtx, NULL));
+    }
+    counters_init(&p->counters);
+    if (0 != interval.tv_sec || 0 != interval.tv_usec) {
+        p->counters.interval = (double) interval.tv_sec + (double) interval.tv_usec / 1000000.0;
+    }
+    if (threshold > 0) {
+        p->counters.threshold = (size_t) threshold;
+    }
+    hotkeys_init(
+        &p->hotkeys,
+        hot_size > 0 ? (size_t) hot_size : 0,
+        hot_sample > 0 ? (unsigned int) hot_sample : 1,
+        (double) hot_ttl.tv_sec + (double) hot_ttl.tv_usec / 1000000.0,
+        hot_rate
+    );
     AN(*pp);
 }
 
@@ -175,27 +988,51 @@ VCL_VOID vmod_driver__fini(struct vmod_keystore_driver **pp)
     CHECK_OBJ_NOTNULL(*pp, VMOD_STORE_OBJ_MAGIC);
 
     p = *pp;
-    p->driver->close(p->private);
+    counters_fini(p);
+    hotkeys_fini(&p->hotkeys);
+    commands_fini(p);
+    connection_release(p->connection);
     FREE_OBJ(*pp);
     *pp = NULL;
 }
 
 VCL_STRING vmod_driver_get(const struct vrt_ctx *ctx, struct vmod_keystore_driver *p, VCL_STRING key)
 {
+    VCL_STRING value;
+    unsigned long generation;
+
     CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
     CHECK_OBJ_NOTNULL(p, VMOD_STORE_OBJ_MAGIC);
     AN(p->driver->get);
 
-    return p->driver->get(ctx->ws, p->private, key);
+    if (p->hotkeys.ttl > 0 && NULL != (value = hotkeys_lookup(ctx->ws, &p->hotkeys, key))) {
+        /* keep counting local hits (without a value, nothing is refetched nor stored) or the key would lose its copy for being hot */
+        if (hotkeys_sampled(&p->hotkeys)) {
+            hotkeys_track(&p->hotkeys, key, NULL, 0);
+        }
+        return value;
+    }
+    generation = __sync_fetch_and_add(&p->hotkeys.generation, 0);
+    value = p->driver->get(ctx->ws, p->private, key);
+    if (hotkeys_sampled(&p->hotkeys)) {
+        hotkeys_track(&p->hotkeys, key, value, generation);
+    }
+
+    return value;
 }
 
 VCL_BOOL vmod_driver_add(const struct vrt_ctx *ctx, struct vmod_keystore_driver *p, VCL_STRING key, VCL_STRING value)
 {
+    VCL_BOOL ret;
+
     CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
     CHECK_OBJ_NOTNULL(p, VMOD_STORE_OBJ_MAGIC);
     AN(p->driver->add);
 
-    return p->driver->add(p->private, key, value);
+    ret = p->driver->add(p->private, key, value);
+    hotkeys_invalidate(&p->hotkeys, key);
+
+    return ret;
 }
 
 VCL_VOID vmod_driver_set(const struct vrt_ctx *ctx, struct vmod_keystore_driver *p, VCL_STRING key, VCL_STRING value)
@@ -204,7 +1041,8 @@ VCL_VOID vmod_driver_set(const struct vrt_ctx *ctx, struct vmod_keystore_driver
     CHECK_OBJ_NOTNULL(p, VMOD_STORE_OBJ_MAGIC);
     AN(p->driver->set);
 
-    return p->driver->set(p->private, key, value);
+    p->driver->set(p->private, key, value);
+    hotkeys_invalidate(&p->hotkeys, key);
 }
 
 VCL_BOOL vmod_driver_exists(const struct vrt_ctx *ctx, struct vmod_keystore_driver *p, VCL_STRING key)
@@ -223,6 +1061,7 @@ VCL_VOID vmod_driver_delete(const struct vrt_ctx *ctx, struct vmod_keystore_driv
     AN(p->driver->delete);
 
     p->driver->delete(p->private, key);
+    hotkeys_invalidate(&p->hotkeys, key);
 }
 
 VCL_VOID vmod_driver_expire(const struct vrt_ctx *ctx, struct vmod_keystore_driver *p, VCL_STRING key, VCL_DURATION duration)
@@ -232,24 +1071,207 @@ VCL_VOID vmod_driver_expire(const struct vrt_ctx *ctx, struct vmod_keystore_driv
     AN(p->driver->expire);
 
     p->driver->expire(p->private, key, duration);
+    hotkeys_invalidate(&p->hotkeys, key);
 }
 
 VCL_INT vmod_driver_increment(const struct vrt_ctx *ctx, struct vmod_keystore_driver *p, VCL_STRING key)
 {
+    VCL_INT ret;
+
     CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
     CHECK_OBJ_NOTNULL(p, VMOD_STORE_OBJ_MAGIC);
     AN(p->driver->increment);
 
-    return p->driver->increment(p->private, key);
+    ret = p->driver->increment(p->private, key);
+    hotkeys_invalidate(&p->hotkeys, key);
+
+    return ret;
 }
 
 VCL_INT vmod_driver_decrement(const struct vrt_ctx *ctx, struct vmod_keystore_driver *p, VCL_STRING key)
 {
+    VCL_INT ret;
+
     CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
     CHECK_OBJ_NOTNULL(p, VMOD_STORE_OBJ_MAGIC);
     AN(p->driver->decrement);
 
-    return p->driver->decrement(p->private, key);
+    ret = p->driver->decrement(p->private, key);
+    hotkeys_invalidate(&p->hotkeys, key);
+
+    return ret;
+}
+
+VCL_VOID vmod_driver_count(const struct vrt_ctx *ctx, struct vmod_keystore_driver *p, VCL_STRING key, VCL_INT by)
+{
+    int notify;
+    unsigned int hash;
+    struct vmod_keystore_counter *c;
+    struct vmod_keystore_counter_shard *shard;
+
+    CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
+    CHECK_OBJ_NOTNULL(p, VMOD_STORE_OBJ_MAGIC);
+    AN(p->driver->increment_by);
+
+    if (NULL == key || 0 == by) {
+        return;
+    }
+    if (!p->counters.running) {
+        AZ(pthread_mutex_lock(&p->counters.mtx));
+        if (!p->counters.running && !p->counters.stopping) {
+            AZ(pthread_create(&p->counters.flusher, NULL, counters_flusher, p));
+            p->counters.running = 1;
+        }
+        AZ(pthread_mutex_unlock(&p->counters.mtx));
+    }
+    hash = hash_key(key);
+    shard = &p->counters.shards[thread_shard()];
+    AZ(pthread_mutex_lock(&shard->mtx));
+    for (c = shard->buckets[hash % COUNTER_BUCKETS]; NULL != c; c = c->next) {
+        if (c->hash == hash && 0 == strcmp(c->key, key)) {
+            break;
+        }
+    }
+    if (NULL == c) {
+        c = malloc(sizeof(*c));
+        AN(c);
+        c->key = strdup(key);
+        AN(c->key);
+        c->hash = hash;
+        c->delta = 0;
+        c->next = shard->buckets[hash % COUNTER_BUCKETS];
+        shard->buckets[hash % COUNTER_BUCKETS] = c;
+        ++shard->pending;
+        notify = __sync_add_and_fetch(&p->counters.pending, 1) >= p->counters.threshold;
+    } else {
+        notify = 0;
+    }
+    c->delta += by;
+    AZ(pthread_mutex_unlock(&shard->mtx));
+    if (notify) {
+        AZ(pthread_mutex_lock(&p->counters.mtx));
+        AZ(pthread_cond_signal(&p->counters.cond));
+        AZ(pthread_mutex_unlock(&p->counters.mtx));
+    }
+}
+
+struct synthetic_body {
+    struct vsb *vsb;
+    ssize_t start;
+};
+
+static void synthetic_truncate(struct synthetic_body *body)
+{
+    /* vsb has no function to remove the end of a buffer */
+    body->vsb->s_len = body->start;
+}
+
+static int synthetic_append(void *arg, const char *data, size_t data_len)
+{
+    struct synthetic_body *body;
+
+    body = (struct synthetic_body *) arg;
+    if (NULL == data) {
+        synthetic_truncate(body);
+        return 1;
+    }
+
+    return 0 == VSB_bcat(body->vsb, data, data_len);
+}
+
+VCL_BOOL vmod_driver_synthetic_from(const struct vrt_ctx *ctx, struct vmod_keystore_driver *p, VCL_STRING key)
+{
+    int ret;
+    struct synthetic_body body;
+
+    CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
+    CHECK_OBJ_NOTNULL(p, VMOD_STORE_OBJ_MAGIC);
+    AN(p->driver->fetch);
+
+    if (VCL_MET_SYNTH == ctx->method) {
+        CHECK_OBJ_NOTNULL(ctx->req, REQ_MAGIC);
+        body.vsb = ctx->req->synth_body;
+    } else if (VCL_MET_BACKEND_ERROR == ctx->method) {
+        CHECK_OBJ_NOTNULL(ctx->bo, BUSYOBJ_MAGIC);
+        body.vsb = ctx->bo->synth_body;
+    } else {
+        VSLb(ctx->vsl, SLT_Error, "synthetic_from can only be used in vcl_synth or vcl_backend_error");
+        return 0;
+    }
+    AN(body.vsb);
+    body.start = VSB_len(body.vsb);
+    if (-1 == (ret = p->driver->fetch(p->private, key, synthetic_append, &body))) {
+        /* never leave a partial value in the body */
+        synthetic_truncate(&body);
+        VSLb(ctx->vsl, SLT_Error, "synthetic_from: failed to read '%s' from %s", key, p->driver->name);
+    }
+
+    return 1 == ret;
+}
+
+static int hotkeys_cmp(const void *a, const void *b)
+{
+    const struct vmod_keystore_hotkey * const *ha = a, * const *hb = b;
+
+    if ((*ha)->count < (*hb)->count) {
+        return 1;
+    } else if ((*ha)->count > (*hb)->count) {
+        return -1;
+    } else {
+        return 0;
+    }
+}
+
+VCL_STRING vmod_driver_hotkeys(const struct vrt_ctx *ctx, struct vmod_keystore_driver *p)
+{
+    double now;
+    size_t i, count;
+    struct vsb *vsb;
+    const char *string;
+    struct vmod_keystore_hotkey **sorted;
+
+    CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
+    CHECK_OBJ_NOTNULL(p, VMOD_STORE_OBJ_MAGIC);
+
+    if (0 == p->hotkeys.size) {
+        return NULL;
+    }
+    vsb = VSB_new_auto();
+    AN(vsb);
+    sorted = malloc(sizeof(*sorted) * p->hotkeys.size);
+    AN(sorted);
+    now = VTIM_mono();
+    AZ(pthread_rwlock_rdlock(&p->hotkeys.lock));
+    count = 0;
+    for (i = 0; i < p->hotkeys.size; i++) {
+        if (NULL != p->hotkeys.slots[i].key) {
+            sorted[count++] = &p->hotkeys.slots[i];
+        }
+    }
+    qsort(sorted, count, sizeof(*sorted), hotkeys_cmp);
+    for (i = 0; i < count; i++) {
+        VSLb(ctx->vsl, SLT_VCL_Log, "keystore hotkey %s %.0f/s%s", sorted[i]->key, hotkeys_rate(&p->hotkeys, sorted[i], now), NULL == sorted[i]->value ? "" : " (local)");
+        VSB_printf(vsb, "%s%s=%.0f", 0 == i ? "" : ",", sorted[i]->key, hotkeys_rate(&p->hotkeys, sorted[i], now));
+    }
+    AZ(pthread_rwlock_unlock(&p->hotkeys.lock));
+    free(sorted);
+    AZ(VSB_finish(vsb));
+    string = WS_Copy(ctx->ws, VSB_data(vsb), VSB_len(vsb) + 1);
+    VSB_delete(vsb);
+
+    return string;
+}
+
+VCL_STRING vmod_driver_stats(const struct vrt_ctx *ctx, struct vmod_keystore_driver *p)
+{
+    CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
+    CHECK_OBJ_NOTNULL(p, VMOD_STORE_OBJ_MAGIC);
+
+    if (NULL == p->driver->stats) {
+        return NULL;
+    } else {
+        return p->driver->stats(ctx->ws, p->private);
+    }
 }
 
 VCL_STRING vmod_driver_name(const struct vrt_ctx *ctx, struct vmod_keystore_driver *p)
@@ -260,6 +1282,121 @@ VCL_STRING vmod_driver_name(const struct vrt_ctx *ctx, struct vmod_keystore_driv
     return p->driver->name;
 }
 
+VCL_VOID vmod_driver_prepare(const struct vrt_ctx *ctx, struct vmod_keystore_driver *p, VCL_STRING name, VCL_STRING template)
+{
+    struct vmod_keystore_command *c;
+
+    CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
+    CHECK_OBJ_NOTNULL(p, VMOD_STORE_OBJ_MAGIC);
+
+    /* commands are only looked up (without lock) once vcl_init is done */
+    if (VCL_MET_INIT != ctx->method) {
+        VSLb(ctx->vsl, SLT_Error, "prepare can only be used in vcl_init");
+        return;
+    }
+    if (NULL == name || NULL == template) {
+        VSLb(ctx->vsl, SLT_Error, "prepare: name and command are required");
+        return;
+    }
+    ALLOC_OBJ(c, COMMAND_MAGIC);
+    AN(c);
+    if (!command_parse(c, template)) {
+        int i;
+
+        VSLb(ctx->vsl, SLT_Error, "prepare: invalid command '%s'", template);
+        for (i = 0; i < c->argc; i++) {
+            free(c->literals[i]);
+        }
+        FREE_OBJ(c);
+        return;
+    }
+    c->name = strdup(name);
+    AN(c->name);
+    VTAILQ_INSERT_TAIL(&p->commands, c, list);
+}
+
+VCL_VOID vmod_driver_bind_int(const struct vrt_ctx *ctx, struct vmod_keystore_driver *p, VCL_INT value)
+{
+    char buffer[COMMAND_ARG_BUFFER_SIZE];
+
+    CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
+    CHECK_OBJ_NOTNULL(p, VMOD_STORE_OBJ_MAGIC);
+
+    snprintf(buffer, sizeof(buffer), "%ld", (long) value);
+    bind_next(ctx, p, COMMAND_ARG_INT, buffer);
+}
+
+VCL_VOID vmod_driver_bind_string(const struct vrt_ctx *ctx, struct vmod_keystore_driver *p, VCL_STRING value)
+{
+    CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
+    CHECK_OBJ_NOTNULL(p, VMOD_STORE_OBJ_MAGIC);
+
+    bind_next(ctx, p, COMMAND_ARG_STRING, value);
+}
+
+VCL_VOID vmod_driver_bind_duration(const struct vrt_ctx *ctx, struct vmod_keystore_driver *p, VCL_DURATION value)
+{
+    char buffer[COMMAND_ARG_BUFFER_SIZE];
+
+    CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
+    CHECK_OBJ_NOTNULL(p, VMOD_STORE_OBJ_MAGIC);
+
+    snprintf(buffer, sizeof(buffer), "%.f", value);
+    bind_next(ctx, p, COMMAND_ARG_DURATION, buffer);
+}
+
+VCL_STRING vmod_driver_exec(const struct vrt_ctx *ctx, struct vmod_keystore_driver *p, VCL_STRING name)
+{
+    VCL_STRING ret;
+    int i, slot, count;
+    const char *argv[COMMAND_MAX_ARGS];
+    size_t argvlen[COMMAND_MAX_ARGS];
+    struct vmod_keystore_command *c;
+    struct vmod_keystore_binding *b;
+
+    CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
+    CHECK_OBJ_NOTNULL(p, VMOD_STORE_OBJ_MAGIC);
+
+    /* whatever happens, bound values are consumed */
+    b = bind_take(ctx, p);
+    count = NULL == b ? 0 : b->count;
+    ret = NULL;
+    VTAILQ_FOREACH(c, &p->commands, list) {
+        CHECK_OBJ(c, COMMAND_MAGIC);
+        if (NULL != name && 0 == strcmp(c->name, name)) {
+            break;
+        }
+    }
+    if (NULL == p->driver->command) {
+        ret = NULL; /* like raw, not supported by this driver */
+    } else if (NULL == c) {
+        VSLb(ctx->vsl, SLT_Error, "exec: no command prepared as '%s'", NULL == name ? "" : name);
+    } else if (count != c->slots) {
+        VSLb(ctx->vsl, SLT_Error, "exec: command '%s' expects %d values, %d bound", c->name, c->slots, count);
+    } else {
+        for (i = slot = 0; i < c->argc; i++) {
+            if (COMMAND_ARG_LITERAL == c->types[i]) {
+                argv[i] = c->literals[i];
+            } else {
+                if (b->args[slot].type != c->types[i]) {
+                    VSLb(ctx->vsl, SLT_Error, "exec: value %d of command '%s' is not of the expected type", slot + 1, c->name);
+                    break;
+                }
+                argv[i] = b->args[slot++].value;
+            }
+            argvlen[i] = strlen(argv[i]);
+        }
+        if (i == c->argc) {
+            ret = p->driver->command(ctx->ws, p->private, c->argc, argv, argvlen);
+        }
+    }
+    if (NULL != b) {
+        binding_free(b);
+    }
+
+    return ret;
+}
+
 VCL_STRING vmod_driver_raw(const struct vrt_ctx *ctx, struct vmod_keystore_driver *p, VCL_STRING cmd)
 {
     CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);